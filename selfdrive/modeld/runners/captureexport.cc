@@ -0,0 +1,328 @@
+// Exports the capture sessions written by ThneedModel (LOGROOT/<session>/img_inputs.bin + files.bin)
+// into fixed-size training shards. Every shard holds one contiguous, page-aligned column per tensor,
+// and manifest.txt in the output folder describes the tensors, shards and source sessions.
+//
+// All complete sessions must share one layout.txt; sessions captured before layout.txt existed are
+// only exported with the 'legacy' argument, which assumes the supercombo sizes for them. Incomplete
+// session folders are skipped.
+//
+// usage: captureexport <logroot> <output folder> [frames per shard] [threads] [legacy]
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fst = std::filesystem;
+
+const size_t ALIGNMENT = 4096;
+
+struct Tensor {
+    std::string name;
+    std::string layout_key;
+    size_t size; // bytes per frame
+};
+
+// Supercombo sizes, only used for sessions without layout.txt when 'legacy' is given
+std::vector<Tensor> TENSORS = {
+    {"features_buffer", "FEATURE_SIZE", 1 * 99 * 128 * sizeof(float)},
+    {"traffic_convention", "TRAFFIC_SIZE", 1 * 2 * sizeof(float)},
+    {"desire", "DESIRE_SIZE", 1 * 100 * 8 * sizeof(float)},
+    {"output", "OUTPUT_SIZE", 1 * 6108 * sizeof(float)},
+    {"big_input_imgs", "ImgSize", 1 * 12 * 128 * 256 * sizeof(float)},
+    {"input_imgs", "ImgSize", 1 * 12 * 128 * 256 * sizeof(float)},
+};
+const size_t IMG_TENSOR = 4; // tensors from here on live in img_inputs.bin
+
+struct Session {
+    std::string name;
+    const char *files;
+    const char *imgs;
+    size_t files_size;
+    size_t imgs_size;
+    size_t frames;
+    size_t first_frame; // global frame index
+    std::vector<size_t> layout;
+};
+
+// Per-tensor byte size of a session from its layout.txt. Falls back to the supercombo sizes
+// only when legacy is set and the session has no layout.txt.
+bool read_layout(const std::string &folder, bool legacy, std::vector<size_t> *sizes) {
+    sizes->clear();
+    for (auto &t : TENSORS) sizes->push_back(t.size);
+
+    std::ifstream ifs(folder + "/layout.txt");
+    if (!ifs.is_open()) return legacy;
+
+    std::vector<bool> found(TENSORS.size(), false);
+    std::string key;
+    size_t value;
+    while (ifs >> key >> value) {
+        for (size_t i = 0; i < TENSORS.size(); i++) {
+            if (TENSORS[i].layout_key == key) {
+                (*sizes)[i] = value;
+                found[i] = true;
+            }
+        }
+    }
+    return std::all_of(found.begin(), found.end(), [](bool f) { return f; });
+}
+
+std::string layout_str(const std::vector<size_t> &sizes) {
+    std::string str;
+    for (size_t i = 0; i < TENSORS.size(); i++) str += (i ? " " : "") + TENSORS[i].name + "=" + std::to_string(sizes[i]);
+    return str;
+}
+
+const char* map_file(const std::string &path, size_t *size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    fstat(fd, &st);
+    *size = st.st_size;
+    void *ptr = *size > 0 ? mmap(nullptr, *size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (ptr == MAP_FAILED) return nullptr;
+    madvise(ptr, *size, MADV_SEQUENTIAL);
+    return static_cast<const char*>(ptr);
+}
+
+size_t align_up(size_t x) {
+    return (x + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+std::string shard_name(size_t shard) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "shard_%05zu.bin", shard);
+    return buf;
+}
+
+// Column offsets inside a shard holding `frames` frames; the last entry is the shard size.
+std::vector<size_t> column_offsets(size_t frames) {
+    std::vector<size_t> offsets = {0};
+    for (auto &t : TENSORS) offsets.push_back(offsets.back() + align_up(t.size * frames));
+    return offsets;
+}
+
+bool write_shard(const std::vector<Session> &sessions, const std::string &path, size_t first_frame, size_t frames) {
+    std::vector<size_t> offsets = column_offsets(frames);
+
+    // reserve the blocks up front, a full disk fails here instead of raising SIGBUS in the copy
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || posix_fallocate(fd, 0, offsets.back()) != 0) {
+        std::cerr << "Error: Failed to create file \"" << path << "\"" << std::endl;
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, offsets.back(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "Error: Failed to map file \"" << path << "\"" << std::endl;
+        close(fd);
+        return false;
+    }
+    char *shard = static_cast<char*>(ptr);
+
+    size_t files_frame = 0;
+    for (size_t i = 0; i < IMG_TENSOR; i++) files_frame += TENSORS[i].size;
+    size_t imgs_frame = 0;
+    for (size_t i = IMG_TENSOR; i < TENSORS.size(); i++) imgs_frame += TENSORS[i].size;
+
+    // first session holding first_frame
+    auto s = std::upper_bound(sessions.begin(), sessions.end(), first_frame,
+                              [](size_t f, const Session &session) { return f < session.first_frame; }) - 1;
+    for (size_t k = 0; k < frames; k++) {
+        size_t frame = first_frame + k;
+        while (frame >= s->first_frame + s->frames) s++;
+        size_t local = frame - s->first_frame;
+
+        // files.bin frame: features | traffic convention | desire | output
+        // img_inputs.bin frame: big input imgs | input imgs
+        const char *src = s->files + local * files_frame;
+        for (size_t i = 0; i < TENSORS.size(); i++) {
+            if (i == IMG_TENSOR) src = s->imgs + local * imgs_frame;
+            std::memcpy(shard + offsets[i] + k * TENSORS[i].size, src, TENSORS[i].size);
+            src += TENSORS[i].size;
+        }
+    }
+
+    // write back before returning, so the reported throughput includes the disk
+    bool ok = msync(ptr, offsets.back(), MS_SYNC) == 0;
+    munmap(ptr, offsets.back());
+    ok = fsync(fd) == 0 && ok;
+    close(fd);
+    if (!ok) {
+        std::cerr << "Error: Failed to write file \"" << path << "\"" << std::endl;
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " <logroot> <output folder> [frames per shard] [threads] [legacy]" << std::endl;
+    return 1;
+  }
+  const std::string logroot = argv[1];
+  const std::string out = argv[2];
+  size_t shard_frames = argc > 3 ? std::stoul(argv[3]) : 100;
+  size_t num_threads = argc > 4 ? std::stoul(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+  bool legacy = argc > 5 && std::string(argv[5]) == "legacy";
+  if (shard_frames == 0 || num_threads == 0) {
+    std::cerr << "Error: frames per shard and threads must be positive" << std::endl;
+    return 1;
+  }
+
+  std::vector<std::string> names;
+  for (auto &entry : fst::directory_iterator(logroot)) {
+    if (entry.is_directory()) names.push_back(entry.path().filename());
+  }
+  // session folders are named after their capture time in ms
+  std::sort(names.begin(), names.end(), [](const std::string &a, const std::string &b) {
+    return a.size() != b.size() ? a.size() < b.size() : a < b;
+  });
+  if (names.empty()) {
+    std::cerr << "Error: no sessions in \"" << logroot << "\"" << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  // map sessions in parallel, each mapping is independent
+  std::vector<Session> mapped(names.size());
+  std::atomic<size_t> next_session = 0;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < num_threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = next_session++; i < names.size(); i = next_session++) {
+        const std::string folder = logroot + "/" + names[i];
+        Session &s = mapped[i];
+        s = {names[i], nullptr, nullptr, 0, 0, 0, 0, {}};
+        if (!read_layout(folder, legacy, &s.layout)) s.layout.clear();
+        s.files = map_file(folder + "/files.bin", &s.files_size);
+        s.imgs = map_file(folder + "/img_inputs.bin", &s.imgs_size);
+      }
+    });
+  }
+  for (auto &w : workers) w.join();
+  workers.clear();
+
+  // interrupted captures and stray folders lack the data files or layout.txt (written last)
+  const Session *reference = nullptr;
+  for (auto &s : mapped) {
+    if (!s.files || !s.imgs) {
+      std::cerr << "Warning: skipping incomplete session " << s.name << std::endl;
+      s.layout.clear();
+    } else if (s.layout.empty()) {
+      std::cerr << "Warning: skipping session " << s.name << " without layout.txt, pass 'legacy' to assume supercombo sizes" << std::endl;
+    } else if (!reference) {
+      reference = &s;
+    }
+  }
+  if (!reference) {
+    std::cerr << "Error: no complete sessions in \"" << logroot << "\"" << std::endl;
+    return 1;
+  }
+
+  // one export has one layout, refuse to guess
+  bool layout_error = false;
+  for (auto &s : mapped) {
+    if (!s.layout.empty() && s.layout != reference->layout) {
+      std::cerr << "Error: session " << s.name << " layout (" << layout_str(s.layout) << ") differs from session "
+                << reference->name << " (" << layout_str(reference->layout) << ")" << std::endl;
+      layout_error = true;
+    }
+  }
+  if (layout_error) return 1;
+
+  for (size_t i = 0; i < TENSORS.size(); i++) TENSORS[i].size = reference->layout[i];
+  size_t files_frame = 0, imgs_frame = 0;
+  for (size_t i = 0; i < TENSORS.size(); i++) (i < IMG_TENSOR ? files_frame : imgs_frame) += TENSORS[i].size;
+
+  for (auto &s : mapped) {
+    if (s.layout.empty()) continue;
+    size_t frames = s.files_size / files_frame;
+    if (frames == 0 || s.files_size != frames * files_frame || s.imgs_size != frames * imgs_frame) {
+      std::cerr << "Warning: skipping incomplete session " << s.name << std::endl;
+      continue;
+    }
+    s.frames = frames;
+  }
+
+  std::vector<Session> sessions;
+  size_t total_frames = 0;
+  for (auto &s : mapped) {
+    if (s.frames == 0) {
+      if (s.files) munmap(const_cast<char*>(s.files), s.files_size);
+      if (s.imgs) munmap(const_cast<char*>(s.imgs), s.imgs_size);
+      continue;
+    }
+    s.first_frame = total_frames;
+    total_frames += s.frames;
+    sessions.push_back(s);
+  }
+  if (total_frames == 0) {
+    std::cerr << "Error: no complete sessions in \"" << logroot << "\"" << std::endl;
+    return 1;
+  }
+
+  fst::create_directories(out);
+  size_t num_shards = (total_frames + shard_frames - 1) / shard_frames;
+  std::atomic<size_t> next_shard = 0;
+  std::atomic<bool> failed = false;
+  for (size_t t = 0; t < std::min(num_threads, num_shards); t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = next_shard++; i < num_shards; i = next_shard++) {
+        size_t first = i * shard_frames;
+        size_t frames = std::min(shard_frames, total_frames - first);
+        if (!write_shard(sessions, out + "/" + shard_name(i), first, frames)) failed = true;
+      }
+    });
+  }
+  for (auto &w : workers) w.join();
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  for (auto &s : sessions) {
+    munmap(const_cast<char*>(s.files), s.files_size);
+    munmap(const_cast<char*>(s.imgs), s.imgs_size);
+  }
+  if (failed) return 1;
+
+  const std::string manifest_path = out + "/manifest.txt";
+  std::ofstream manifest(manifest_path);
+  if (!manifest.is_open()) {
+    std::cerr << "Error: Failed to open file \"" << manifest_path << "\"" << std::endl;
+    return 1;
+  }
+  manifest << "# tensor <name> <bytes per frame>\n";
+  for (auto &t : TENSORS) manifest << "tensor " << t.name << " " << t.size << "\n";
+  manifest << "# shard <file> <frames> <first frame> <column offset per tensor>\n";
+  for (size_t i = 0; i < num_shards; i++) {
+    size_t first = i * shard_frames;
+    size_t frames = std::min(shard_frames, total_frames - first);
+    std::vector<size_t> offsets = column_offsets(frames);
+    manifest << "shard " << shard_name(i) << " " << frames << " " << first;
+    for (size_t j = 0; j < TENSORS.size(); j++) manifest << " " << offsets[j];
+    manifest << "\n";
+  }
+  manifest << "# session <name> <frames> <first frame>\n";
+  for (auto &s : sessions) manifest << "session " << s.name << " " << s.frames << " " << s.first_frame << "\n";
+  manifest.close();
+
+  double gbytes = total_frames * (files_frame + imgs_frame) / 1e9;
+  std::cerr << "exported " << total_frames << " frames from " << sessions.size() << " sessions into "
+            << num_shards << " shards with " << num_threads << " threads" << std::endl;
+  std::cerr << "throughput : " << gbytes / seconds << " GB/s (" << gbytes << " GB in " << seconds << " s)" << std::endl;
+  return 0;
+}
@@ -8,12 +8,29 @@
 #include <string>
 #include <cstring> // For std::memcpy
 #include <filesystem>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 int accumulateDatas = 100; // 100 frames
 int waitRecovery = 10; // 10s
 int collectData = 1; // 1:true, 0:false
 int readyToSave = 1; // 1:true, 0:false
 long finishStamp = 0; 
+int healthMonitor = 1; // 1:true, 0:false
+float healthDeltaLimit = 0.f; // alert when the output delta norm exceeds this, 0:off
+float healthRangeLimit = 0.f; // alert when an output value exceeds +-this, 0:off
+int healthLogInterval = 0; // print the health record every n frames, 0:off
+int healthCaptureGap = 60; // min seconds between alert-triggered captures
+int healthCapture = 0; // 1: an alert started a capture that is still filling the buffer
+long healthCaptureStamp = 0;
+int captureSetup = 1; // 0: skip ./runners config, LOGROOT and capture buffers (thneedreplay)
 
 const std::string LOGROOT = "/data/openpilot_log";
 namespace fst = std::filesystem;
@@ -49,31 +66,73 @@ struct CallbackData {
 
 CallbackData* DATA;
 
-int read_config(const std::string &filename) {
+struct TensorHealth {
+    size_t nan_count;
+    size_t inf_count;
+    float min;
+    float max;
+    float mean;
+    float delta_norm; // L2 norm of the change since the previous frame
+};
+
+struct HealthRecord {
+    long frame_id;
+    long timestamp; // ms
+    long scan_us;
+    bool alert;
+    TensorHealth output;
+    TensorHealth recurrent;
+};
+
+HealthRecord HEALTH = {};
+std::vector<float> PREV_OUTPUT;
+std::vector<float> PREV_RECURRENT;
+
+bool read_config_str(const std::string &filename, std::string *str) {
     //std::filesystem::path current_path = std::filesystem::current_path();
     //std::cerr << current_path;
     std::ifstream ifs;
-    std::string str;
 
     ifs.open(filename);
     
     if (!ifs.is_open()) {
 	std::cerr << "Failed to open file.\n";
-        return 1; // EXIT_FAILURE
+        return false;
     }
     // Read the entire file into the string
-    str.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    str->assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
     ifs.close();
+    return true;
+}
+
+int read_config(const std::string &filename, int fallback = 1) {
+    std::string str;
+    if (!read_config_str(filename, &str)) return fallback;
 
     // Convert the string to an integer and return it
     try {
         return std::stoi(str);
     } catch(const std::invalid_argument& e) {
         std::cerr << "Invalid argument: " << e.what() << '\n';
-        return 1; // EXIT_FAILURE
+        return fallback;
     } catch(const std::out_of_range& e) {
         std::cerr << "Out of range: " << e.what() << '\n';
-        return 1; // EXIT_FAILURE
+        return fallback;
+    }
+}
+
+float read_config_float(const std::string &filename, float fallback) {
+    std::string str;
+    if (!read_config_str(filename, &str)) return fallback;
+
+    try {
+        return std::stof(str);
+    } catch(const std::invalid_argument& e) {
+        std::cerr << "Invalid argument: " << e.what() << '\n';
+        return fallback;
+    } catch(const std::out_of_range& e) {
+        std::cerr << "Out of range: " << e.what() << '\n';
+        return fallback;
     }
 }
 
@@ -123,6 +182,21 @@ void CL_CALLBACK write_complete_callback(cl_event event, cl_int status, void *us
     output_file.write(file_buffer->data(), file_buffer->size());
     output_file.close();
 
+    // Byte sizes of the interleaved tensors, so readers don't have to know the model
+    const std::string& layout_path = FOLDER + "/layout.txt";
+    // the session data is already written, so keep capturing even if this fails
+    std::ofstream output_layout(layout_path);
+    if (!output_layout.is_open()) {
+        std::cerr << "Error: Failed to open file \"" << layout_path << "\"" << std::endl;
+    } else {
+        output_layout << "FEATURE_SIZE " << FEATURE_SIZE << "\n"
+                      << "TRAFFIC_SIZE " << TRAFFIC_SIZE << "\n"
+                      << "DESIRE_SIZE " << DESIRE_SIZE << "\n"
+                      << "OUTPUT_SIZE " << OUTPUT_SIZE << "\n"
+                      << "ImgSize " << ImgSize << "\n";
+        output_layout.close();
+    }
+
     // Release event object
     err = clReleaseEvent(event);
     if (err != CL_SUCCESS) {
@@ -172,15 +246,183 @@ bool save_clmem_to_file(const cl_mem cl_mem_obj, cl_context context, cl_command_
 }
 
 
-ThneedModel::ThneedModel(const char *path, float *loutput, size_t loutput_size, int runtime, bool luse_extra, bool luse_tf8, cl_context context) {
-  accumulateDatas = read_config("./runners/accumulateDatas.txt");
-  waitRecovery = read_config("./runners/waitRecovery.txt");
-  collectData = read_config("./runners/collectData.txt");
+// Scan one tensor for NaN/Inf and min/max/mean over its finite values.
+// prev holds last frame's values; it is compared against and overwritten in the same pass.
+void scan_tensor(const float* src, float* prev, size_t n, TensorHealth* h) {
+    size_t nan_count = 0;
+    size_t nonfinite_count = 0;
+    float vmin = std::numeric_limits<float>::infinity();
+    float vmax = -std::numeric_limits<float>::infinity();
+    float sum = 0.f;
+    float delta = 0.f;
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 pinf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    const __m256 ninf = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    __m256 min8 = pinf, max8 = ninf, sum8 = zero, delta8 = zero;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(src + i);
+        __m256 p = _mm256_loadu_ps(prev + i);
+        // x - x is 0 for finite values and NaN for NaN/Inf
+        __m256 finite = _mm256_cmp_ps(_mm256_sub_ps(x, x), zero, _CMP_EQ_OQ);
+        __m256 is_nan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+        nan_count += __builtin_popcount(_mm256_movemask_ps(is_nan));
+        nonfinite_count += 8 - __builtin_popcount(_mm256_movemask_ps(finite));
+        min8 = _mm256_min_ps(min8, _mm256_blendv_ps(pinf, x, finite));
+        max8 = _mm256_max_ps(max8, _mm256_blendv_ps(ninf, x, finite));
+        sum8 = _mm256_add_ps(sum8, _mm256_and_ps(x, finite));
+        __m256 d = _mm256_sub_ps(x, p);
+        d = _mm256_and_ps(d, _mm256_cmp_ps(_mm256_sub_ps(d, d), zero, _CMP_EQ_OQ));
+        delta8 = _mm256_add_ps(delta8, _mm256_mul_ps(d, d));
+        _mm256_storeu_ps(prev + i, x);
+    }
+    alignas(32) float lanes[4][8];
+    _mm256_store_ps(lanes[0], min8);
+    _mm256_store_ps(lanes[1], max8);
+    _mm256_store_ps(lanes[2], sum8);
+    _mm256_store_ps(lanes[3], delta8);
+    for (int k = 0; k < 8; k++) {
+        vmin = std::min(vmin, lanes[0][k]);
+        vmax = std::max(vmax, lanes[1][k]);
+        sum += lanes[2][k];
+        delta += lanes[3][k];
+    }
+#elif defined(__aarch64__)
+    const float32x4_t zero = vdupq_n_f32(0.f);
+    const float32x4_t pinf = vdupq_n_f32(std::numeric_limits<float>::infinity());
+    const float32x4_t ninf = vdupq_n_f32(-std::numeric_limits<float>::infinity());
+    float32x4_t min4 = pinf, max4 = ninf, sum4 = zero, delta4 = zero;
+    uint32x4_t nan4 = vdupq_n_u32(0), finite4 = vdupq_n_u32(0);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vld1q_f32(src + i);
+        float32x4_t p = vld1q_f32(prev + i);
+        // x - x is 0 for finite values and NaN for NaN/Inf
+        uint32x4_t finite = vceqq_f32(vsubq_f32(x, x), zero);
+        // masks are all ones (-1), so subtracting them counts lanes
+        nan4 = vsubq_u32(nan4, vmvnq_u32(vceqq_f32(x, x)));
+        finite4 = vsubq_u32(finite4, finite);
+        min4 = vminq_f32(min4, vbslq_f32(finite, x, pinf));
+        max4 = vmaxq_f32(max4, vbslq_f32(finite, x, ninf));
+        sum4 = vaddq_f32(sum4, vbslq_f32(finite, x, zero));
+        float32x4_t d = vsubq_f32(x, p);
+        d = vbslq_f32(vceqq_f32(vsubq_f32(d, d), zero), d, zero);
+        delta4 = vfmaq_f32(delta4, d, d);
+        vst1q_f32(prev + i, x);
+    }
+    nan_count += vaddvq_u32(nan4);
+    nonfinite_count += i - vaddvq_u32(finite4);
+    vmin = vminvq_f32(min4);
+    vmax = vmaxvq_f32(max4);
+    sum = vaddvq_f32(sum4);
+    delta = vaddvq_f32(delta4);
+#endif
+
+    for (; i < n; i++) {
+        float x = src[i];
+        float d = x - prev[i];
+        prev[i] = x;
+        if (std::isnan(x)) nan_count++;
+        if (!std::isfinite(x)) {
+            nonfinite_count++;
+            continue;
+        }
+        vmin = std::min(vmin, x);
+        vmax = std::max(vmax, x);
+        sum += x;
+        if (std::isfinite(d)) delta += d * d;
+    }
 
-  std::cerr << "accumulate data : " << accumulateDatas << std::endl;
-  std::cerr << "wait recovery : " << waitRecovery << std::endl;
-  std::cerr << "collect data : " << collectData << std::endl;
-  fst::create_directory(LOGROOT);
+    size_t finite_count = n - nonfinite_count;
+    h->nan_count = nan_count;
+    h->inf_count = nonfinite_count - nan_count;
+    h->min = finite_count ? vmin : NAN;
+    h->max = finite_count ? vmax : NAN;
+    h->mean = finite_count ? sum / finite_count : NAN;
+    h->delta_norm = std::sqrt(delta);
+}
+
+void log_health(const char *tag) {
+    std::cerr << tag << " frame " << HEALTH.frame_id << " at " << HEALTH.timestamp << "ms, scan " << HEALTH.scan_us << "us"
+              << " | output nan " << HEALTH.output.nan_count << " inf " << HEALTH.output.inf_count
+              << " min " << HEALTH.output.min << " max " << HEALTH.output.max << " mean " << HEALTH.output.mean
+              << " delta " << HEALTH.output.delta_norm
+              << " | recurrent nan " << HEALTH.recurrent.nan_count << " inf " << HEALTH.recurrent.inf_count
+              << " min " << HEALTH.recurrent.min << " max " << HEALTH.recurrent.max << " mean " << HEALTH.recurrent.mean
+              << " delta " << HEALTH.recurrent.delta_norm << std::endl;
+}
+
+// Fill HEALTH for this frame. Returns true on the frame where the outputs turn unhealthy.
+bool check_health(const float* output, const float* recurrent, long ms) {
+    auto start = std::chrono::steady_clock::now();
+    bool first_frame = HEALTH.frame_id == 0;
+    bool was_alert = HEALTH.alert;
+
+    scan_tensor(output, PREV_OUTPUT.data(), PREV_OUTPUT.size(), &HEALTH.output);
+    scan_tensor(recurrent, PREV_RECURRENT.data(), PREV_RECURRENT.size(), &HEALTH.recurrent);
+    if (first_frame) {
+        HEALTH.output.delta_norm = 0.f;
+        HEALTH.recurrent.delta_norm = 0.f;
+    }
+
+    HEALTH.frame_id++;
+    HEALTH.timestamp = ms;
+    const TensorHealth &out = HEALTH.output;
+    bool non_finite = out.nan_count + out.inf_count + HEALTH.recurrent.nan_count + HEALTH.recurrent.inf_count > 0;
+    // a model that stopped updating repeats its output exactly
+    bool frozen = !first_frame and out.delta_norm == 0.f;
+    bool jumped = healthDeltaLimit > 0.f and out.delta_norm > healthDeltaLimit;
+    bool out_of_range = healthRangeLimit > 0.f and std::max(std::abs(out.min), std::abs(out.max)) > healthRangeLimit;
+    HEALTH.alert = non_finite or frozen or jumped or out_of_range;
+    HEALTH.scan_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (HEALTH.alert and !was_alert) {
+        std::cerr << "Warning: unhealthy model output (" << (non_finite ? "non-finite " : "") << (frozen ? "frozen " : "")
+                  << (jumped ? "delta " : "") << (out_of_range ? "range " : "") << ")" << std::endl;
+        log_health("health alert");
+    } else if (healthLogInterval > 0 and HEALTH.frame_id % healthLogInterval == 0) {
+        log_health("health");
+    }
+    return HEALTH.alert and !was_alert;
+}
+
+
+// Read the ./runners config files and create LOGROOT, turning collection off if that fails.
+void setup_capture() {
+    accumulateDatas = read_config("./runners/accumulateDatas.txt");
+    waitRecovery = read_config("./runners/waitRecovery.txt");
+    collectData = read_config("./runners/collectData.txt");
+    healthMonitor = read_config("./runners/healthMonitor.txt");
+    healthDeltaLimit = read_config_float("./runners/healthDeltaLimit.txt", 0.f);
+    healthRangeLimit = read_config_float("./runners/healthRangeLimit.txt", 0.f);
+    healthLogInterval = read_config("./runners/healthLogInterval.txt", 0);
+    healthCaptureGap = read_config("./runners/healthCaptureGap.txt", 60);
+
+    std::cerr << "accumulate data : " << accumulateDatas << std::endl;
+    std::cerr << "wait recovery : " << waitRecovery << std::endl;
+    std::cerr << "collect data : " << collectData << std::endl;
+    std::cerr << "health monitor : " << healthMonitor << std::endl;
+    std::cerr << "health delta limit : " << healthDeltaLimit << std::endl;
+    std::cerr << "health range limit : " << healthRangeLimit << std::endl;
+    std::cerr << "health log interval : " << healthLogInterval << std::endl;
+    std::cerr << "health capture gap : " << healthCaptureGap << std::endl;
+
+    std::error_code ec;
+    fst::create_directory(LOGROOT, ec);
+    if (ec) {
+        std::cerr << "Error: Failed to create \"" << LOGROOT << "\" (" << ec.message() << "), data collection disabled" << std::endl;
+        collectData = 0;
+    }
+}
+
+
+ThneedModel::ThneedModel(const char *path, float *loutput, size_t loutput_size, int runtime, bool luse_extra, bool luse_tf8, cl_context context) {
+  if (captureSetup == 1) {
+    setup_capture();
+  } else {
+    collectData = 0;
+  }
 
   thneed = new Thneed(true, context);
   thneed->load(path);
@@ -198,13 +440,17 @@ ThneedModel::ThneedModel(const char *path, float *loutput, size_t loutput_size,
   std::cerr << "DESIRE_SIZE : " << DESIRE_SIZE << std::endl;
   std::cerr << "OUTPUT_SIZE : " << OUTPUT_SIZE << std::endl;
   std::cerr << "FILE_SIZE : " << FILE_SIZE << std::endl;
-  if (luse_extra){
-  IMGBUFFER = std::make_shared<std::vector<char>>(ImgSize * accumulateDatas * 2);
-  } else{
-  IMGBUFFER = std::make_shared<std::vector<char>>(ImgSize * accumulateDatas);
+  if (collectData == 1) {
+    if (luse_extra){
+      IMGBUFFER = std::make_shared<std::vector<char>>(ImgSize * accumulateDatas * 2);
+    } else{
+      IMGBUFFER = std::make_shared<std::vector<char>>(ImgSize * accumulateDatas);
+    }
+    FILEBUFFER = std::make_shared<std::vector<char>>(FILE_SIZE * accumulateDatas);
+    DATA = new CallbackData{IMGBUFFER, FILEBUFFER, ImgSize, 0, accumulateDatas};
   }
-  FILEBUFFER = std::make_shared<std::vector<char>>(FILE_SIZE * accumulateDatas);
-  DATA = new CallbackData{IMGBUFFER, FILEBUFFER, ImgSize, 0, accumulateDatas};
+  PREV_OUTPUT.assign(OUTPUT_SIZE / sizeof(float), 0.f);
+  PREV_RECURRENT.assign(FEATURE_SIZE / sizeof(float), 0.f);
   
   recorded = false;
   output = loutput;
@@ -273,21 +519,28 @@ void ThneedModel::execute() {
 
       float *inputs[5] = {recurrent, trafficConvention, desire, extra, input};
       thneed->execute(inputs, output);
+      bool turned_unhealthy = healthMonitor == 1 and check_health(output, recurrent, ms);
+      // an alert starts a full capture right away instead of waiting for recovery, at most once per gap
+      if (turned_unhealthy and ms - healthCaptureStamp > healthCaptureGap * 1000) {
+        healthCapture = 1;
+        healthCaptureStamp = ms;
+      }
       size_t current_offset;
       //std::cerr << " ms - finishStamp: " << ms-finishStamp << ", ready to save : " << readyToSave << std::endl;
-      if (collectData == 1 and (ms - finishStamp) > waitRecovery * 1000 and readyToSave == 1) {
+      if (collectData == 1 and ((ms - finishStamp) > waitRecovery * 1000 or healthCapture == 1) and readyToSave == 1) {
         current_offset = save_to_buffer(recurrent, 0, FEATURE_SIZE);
         current_offset = save_to_buffer(trafficConvention, current_offset, TRAFFIC_SIZE);
         current_offset = save_to_buffer(desire, current_offset, DESIRE_SIZE);
         current_offset = save_to_buffer(output, current_offset, OUTPUT_SIZE);
       	save_clmem_to_file(thneed->input_clmem[3], thneed->context, thneed->command_queue, false);
         save_clmem_to_file(thneed->input_clmem[4], thneed->context, thneed->command_queue, true);
+        if (DATA->files_written >= DATA->max_files) healthCapture = 0;
       }
 
     } else {
       float *inputs[4] = {recurrent, trafficConvention, desire, input};
       thneed->execute(inputs, output);
-      
+      if (healthMonitor == 1) check_health(output, recurrent, ms);
     }
   }
 }
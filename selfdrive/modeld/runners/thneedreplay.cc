@@ -0,0 +1,138 @@
+// Replays a capture session written by ThneedModel (LOGROOT/<session>/img_inputs.bin + files.bin)
+// back through the model as fast as possible and compares the new outputs to the recorded ones.
+//
+// usage: thneedreplay <model.thneed> <session folder> [atol] [rtol] [cpu]
+
+#include "selfdrive/modeld/runners/thneedmodel.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/clutil.h"
+#include "selfdrive/modeld/models/driving.h"
+
+// 0 keeps the ThneedModel constructor away from LOGROOT and the capture buffers
+extern int captureSetup;
+extern int healthMonitor;
+// set up by the ThneedModel constructor
+extern size_t DESIRE_SIZE;
+extern size_t TRAFFIC_SIZE;
+extern size_t FEATURE_SIZE;
+extern size_t OUTPUT_SIZE;
+extern size_t FILE_SIZE;
+extern size_t ImgSize;
+
+struct MappedFile {
+    char *data;
+    size_t size;
+};
+
+bool map_file(const std::string &path, MappedFile *file) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Failed to open file \"" << path << "\"" << std::endl;
+        return false;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    file->size = st.st_size;
+    // private mapping, the model inputs are taken as non-const float*
+    void *ptr = mmap(nullptr, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "Error: Failed to map file \"" << path << "\"" << std::endl;
+        return false;
+    }
+    madvise(ptr, file->size, MADV_SEQUENTIAL);
+    file->data = static_cast<char*>(ptr);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " <model.thneed> <session folder> [atol] [rtol] [cpu]" << std::endl;
+    return 1;
+  }
+  const std::string folder = argv[2];
+  float atol = argc > 3 ? std::stof(argv[3]) : 1e-3;
+  float rtol = argc > 4 ? std::stof(argv[4]) : 1e-3;
+  bool use_cpu = argc > 5 && std::string(argv[5]) == "cpu";
+
+  cl_device_id device_id = cl_get_device_id(use_cpu ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+
+  // captures are only written in extra mode, see ThneedModel::execute
+  std::vector<float> output(NET_OUTPUT_SIZE);
+  captureSetup = 0;
+  // keep the health scan out of the timed execute
+  healthMonitor = 0;
+  ThneedModel model(argv[1], output.data(), output.size(), 0, true, false, context);
+
+  if (OUTPUT_SIZE != output.size() * sizeof(float)) {
+    std::cerr << "Error: model output is " << OUTPUT_SIZE << " bytes, expected " << output.size() * sizeof(float) << std::endl;
+    return 1;
+  }
+
+  MappedFile imgs, files;
+  if (!map_file(folder + "/img_inputs.bin", &imgs) || !map_file(folder + "/files.bin", &files)) {
+    return 1;
+  }
+  size_t frames = files.size / FILE_SIZE;
+  if (frames == 0 || files.size != frames * FILE_SIZE || imgs.size != frames * 2 * ImgSize) {
+    std::cerr << "Error: session does not match the model layout (files.bin " << files.size
+              << " bytes, img_inputs.bin " << imgs.size << " bytes)" << std::endl;
+    return 1;
+  }
+  std::cerr << "replaying " << frames << " frames from " << folder << std::endl;
+
+  size_t bad_frames = 0;
+  float max_err = 0.f;
+  double exec_ms = 0.;
+  for (size_t i = 0; i < frames; i++) {
+    // files.bin frame: recurrent | traffic convention | desire | output
+    char *frame = files.data + i * FILE_SIZE;
+    const float *recorded = reinterpret_cast<const float*>(frame + FEATURE_SIZE + TRAFFIC_SIZE + DESIRE_SIZE);
+    model.addRecurrent(reinterpret_cast<float*>(frame), FEATURE_SIZE / sizeof(float));
+    model.addTrafficConvention(reinterpret_cast<float*>(frame + FEATURE_SIZE), TRAFFIC_SIZE / sizeof(float));
+    model.addDesire(reinterpret_cast<float*>(frame + FEATURE_SIZE + TRAFFIC_SIZE), DESIRE_SIZE / sizeof(float));
+    // img_inputs.bin frame: big input imgs | input imgs
+    model.addExtra(reinterpret_cast<float*>(imgs.data + i * 2 * ImgSize), ImgSize / sizeof(float));
+    model.addImage(reinterpret_cast<float*>(imgs.data + i * 2 * ImgSize + ImgSize), ImgSize / sizeof(float));
+
+    auto start = std::chrono::steady_clock::now();
+    model.execute();
+    // the first frame records the thneed, keep it out of the benchmark
+    if (i > 0) exec_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    size_t mismatches = 0;
+    for (size_t j = 0; j < output.size(); j++) {
+      float err = std::abs(output[j] - recorded[j]);
+      if (!(err <= atol + rtol * std::abs(recorded[j]))) mismatches++;
+      if (err > max_err) max_err = err;
+    }
+    if (mismatches > 0) {
+      bad_frames++;
+      std::cerr << "frame " << i << ": " << mismatches << " of " << output.size() << " outputs out of tolerance" << std::endl;
+    }
+  }
+
+  munmap(imgs.data, imgs.size);
+  munmap(files.data, files.size);
+
+  if (frames > 1) {
+    std::cerr << "throughput : " << (frames - 1) * 1000. / exec_ms << " frames/s, "
+              << exec_ms / (frames - 1) << " ms/frame" << std::endl;
+  }
+  std::cerr << "max abs error : " << max_err << std::endl;
+  std::cerr << "frames out of tolerance : " << bad_frames << "/" << frames << std::endl;
+  return bad_frames == 0 ? 0 : 1;
+}